@@ -8,7 +8,18 @@
 #include <sstream>
 #include <vector>
 #include <memory>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 class GrabServer
 {
@@ -47,6 +58,262 @@ inline std::vector<std::string> split(const std::string &s, char delim)
     return elems;
 }
 
+struct JsonValue
+{
+    enum Type { Null, Bool, Number, String, Array, Object };
+
+    JsonValue() : type(Null), boolean(false), number(0) { }
+
+    const JsonValue* find(const char* key) const;
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue> > object;
+};
+
+const JsonValue* JsonValue::find(const char* key) const
+{
+    for (const auto& item : object) {
+        if (item.first == key)
+            return &item.second;
+    }
+    return nullptr;
+}
+
+// just enough JSON to read rule files without going through V8
+class JsonParser
+{
+public:
+    JsonParser(const char* data, size_t size)
+        : mBegin(data), mCur(data), mEnd(data + size), mDepth(0)
+    {
+    }
+
+    bool parse(JsonValue* value, std::string* error);
+
+private:
+    bool parseValue(JsonValue* value);
+    bool parseString(std::string* str);
+    bool parseNumber(double* number);
+    bool parseLiteral(const char* literal);
+    bool fail(const char* message);
+    void skipSpace();
+
+    const char* mBegin;
+    const char* mCur;
+    const char* mEnd;
+    int mDepth;
+    std::string mError;
+};
+
+bool JsonParser::parse(JsonValue* value, std::string* error)
+{
+    if (parseValue(value)) {
+        skipSpace();
+        if (mCur == mEnd)
+            return true;
+        fail("Trailing data");
+    }
+    *error = mError;
+    return false;
+}
+
+bool JsonParser::fail(const char* message)
+{
+    if (mError.empty())
+        mError = std::string(message) + " at offset " + std::to_string(mCur - mBegin);
+    return false;
+}
+
+inline void JsonParser::skipSpace()
+{
+    while (mCur != mEnd && (*mCur == ' ' || *mCur == '\t' || *mCur == '\n' || *mCur == '\r'))
+        ++mCur;
+}
+
+bool JsonParser::parseLiteral(const char* literal)
+{
+    const size_t len = strlen(literal);
+    if (static_cast<size_t>(mEnd - mCur) < len || strncmp(mCur, literal, len))
+        return fail("Invalid literal");
+    mCur += len;
+    return true;
+}
+
+bool JsonParser::parseNumber(double* number)
+{
+    const char* start = mCur;
+    while (mCur != mEnd && *mCur != '\0' && strchr("+-0123456789.eE", *mCur))
+        ++mCur;
+    const std::string str(start, mCur);
+    char* end;
+    *number = strtod(str.c_str(), &end);
+    if (str.empty() || *end != '\0' || !std::isfinite(*number)) {
+        mCur = start;
+        return fail("Invalid number");
+    }
+    return true;
+}
+
+bool JsonParser::parseString(std::string* str)
+{
+    // opening quote already checked by the caller
+    ++mCur;
+    while (mCur != mEnd) {
+        const char c = *mCur++;
+        if (c == '"')
+            return true;
+        if (c != '\\') {
+            str->push_back(c);
+            continue;
+        }
+        if (mCur == mEnd)
+            break;
+        switch (*mCur++) {
+        case '"': str->push_back('"'); break;
+        case '\\': str->push_back('\\'); break;
+        case '/': str->push_back('/'); break;
+        case 'b': str->push_back('\b'); break;
+        case 'f': str->push_back('\f'); break;
+        case 'n': str->push_back('\n'); break;
+        case 'r': str->push_back('\r'); break;
+        case 't': str->push_back('\t'); break;
+        case 'u': {
+            auto hex = [this](uint32_t* out) -> bool {
+                if (mEnd - mCur < 4)
+                    return false;
+                const std::string digits(mCur, 4);
+                char* end;
+                *out = strtoul(digits.c_str(), &end, 16);
+                mCur += 4;
+                return *end == '\0';
+            };
+            uint32_t cp;
+            if (!hex(&cp))
+                return fail("Invalid unicode escape");
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                uint32_t low;
+                if (mEnd - mCur < 2 || mCur[0] != '\\' || mCur[1] != 'u')
+                    return fail("Invalid surrogate pair");
+                mCur += 2;
+                if (!hex(&low) || low < 0xdc00 || low >= 0xe000)
+                    return fail("Invalid surrogate pair");
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+            if (cp < 0x80) {
+                str->push_back(cp);
+            } else if (cp < 0x800) {
+                str->push_back(0xc0 | (cp >> 6));
+                str->push_back(0x80 | (cp & 0x3f));
+            } else if (cp < 0x10000) {
+                str->push_back(0xe0 | (cp >> 12));
+                str->push_back(0x80 | ((cp >> 6) & 0x3f));
+                str->push_back(0x80 | (cp & 0x3f));
+            } else {
+                str->push_back(0xf0 | (cp >> 18));
+                str->push_back(0x80 | ((cp >> 12) & 0x3f));
+                str->push_back(0x80 | ((cp >> 6) & 0x3f));
+                str->push_back(0x80 | (cp & 0x3f));
+            }
+            break; }
+        default:
+            return fail("Invalid escape");
+        }
+    }
+    return fail("Unterminated string");
+}
+
+bool JsonParser::parseValue(JsonValue* value)
+{
+    skipSpace();
+    if (mCur == mEnd)
+        return fail("Unexpected end of data");
+    if (mDepth > 64)
+        return fail("Nesting too deep");
+
+    switch (*mCur) {
+    case '{': {
+        ++mCur;
+        ++mDepth;
+        value->type = JsonValue::Object;
+        skipSpace();
+        if (mCur != mEnd && *mCur == '}') {
+            ++mCur;
+            --mDepth;
+            return true;
+        }
+        for (;;) {
+            skipSpace();
+            if (mCur == mEnd || *mCur != '"')
+                return fail("Expected key");
+            value->object.push_back(std::make_pair(std::string(), JsonValue()));
+            if (!parseString(&value->object.back().first))
+                return false;
+            skipSpace();
+            if (mCur == mEnd || *mCur != ':')
+                return fail("Expected ':'");
+            ++mCur;
+            if (!parseValue(&value->object.back().second))
+                return false;
+            skipSpace();
+            if (mCur != mEnd && *mCur == ',') {
+                ++mCur;
+            } else if (mCur != mEnd && *mCur == '}') {
+                ++mCur;
+                --mDepth;
+                return true;
+            } else {
+                return fail("Expected ',' or '}'");
+            }
+        }
+    }
+    case '[': {
+        ++mCur;
+        ++mDepth;
+        value->type = JsonValue::Array;
+        skipSpace();
+        if (mCur != mEnd && *mCur == ']') {
+            ++mCur;
+            --mDepth;
+            return true;
+        }
+        for (;;) {
+            value->array.push_back(JsonValue());
+            if (!parseValue(&value->array.back()))
+                return false;
+            skipSpace();
+            if (mCur != mEnd && *mCur == ',') {
+                ++mCur;
+            } else if (mCur != mEnd && *mCur == ']') {
+                ++mCur;
+                --mDepth;
+                return true;
+            } else {
+                return fail("Expected ',' or ']'");
+            }
+        }
+    }
+    case '"':
+        value->type = JsonValue::String;
+        return parseString(&value->string);
+    case 't':
+        value->type = JsonValue::Bool;
+        value->boolean = true;
+        return parseLiteral("true");
+    case 'f':
+        value->type = JsonValue::Bool;
+        return parseLiteral("false");
+    case 'n':
+        return parseLiteral("null");
+    default:
+        value->type = JsonValue::Number;
+        return parseNumber(&value->number);
+    }
+}
+
 namespace std {
 template<>
 struct hash<std::vector<std::string> >
@@ -66,11 +333,197 @@ struct hash<std::vector<std::string> >
 };
 } // namespace std
 
+// Opt-in fixed size ring buffer of timestamped records, exported in the
+// Chrome trace event format. Records on a window go on that window's track.
+class Tracer
+{
+public:
+    struct Record
+    {
+        uint64_t start, duration;   // ns, duration of 0 means instant
+        xcb_window_t window;
+        uint32_t arg;
+        const char* name;
+        char detail[32];
+    };
+
+    Tracer() : mEnabled(false), mNext(0), mCount(0) {}
+
+    void start(size_t capacity);
+    void stop() { mEnabled = false; }
+    bool enabled() const { return mEnabled; }
+
+    void instant(const char* name, xcb_window_t window, uint32_t arg = 0, const char* detail = nullptr)
+    {
+        if (mEnabled)
+            record(name, window, arg, detail, uv_hrtime(), 0);
+    }
+
+    class Span
+    {
+    public:
+        Span(Tracer& tracer, const char* name, xcb_window_t window = XCB_WINDOW_NONE, uint32_t arg = 0)
+            : mTracer(tracer), mName(name), mWindow(window), mArg(arg), mStart(tracer.enabled() ? uv_hrtime() : 0)
+        {
+        }
+        ~Span()
+        {
+            if (mStart && mTracer.enabled()) {
+                const uint64_t now = uv_hrtime();
+                mTracer.record(mName, mWindow, mArg, nullptr, mStart, std::max<uint64_t>(now - mStart, 1));
+            }
+        }
+
+    private:
+        Tracer& mTracer;
+        const char* mName;
+        xcb_window_t mWindow;
+        uint32_t mArg;
+        uint64_t mStart;
+    };
+
+    std::string json() const;
+
+private:
+    void record(const char* name, xcb_window_t window, uint32_t arg, const char* detail, uint64_t start, uint64_t duration);
+
+    bool mEnabled;
+    std::vector<Record> mRecords;
+    size_t mNext, mCount;
+};
+
+void Tracer::start(size_t capacity)
+{
+    mRecords.assign(std::max<size_t>(capacity, 1), Record());
+    mNext = mCount = 0;
+    mEnabled = true;
+}
+
+void Tracer::record(const char* name, xcb_window_t window, uint32_t arg, const char* detail, uint64_t start, uint64_t duration)
+{
+    Record& rec = mRecords[mNext];
+    rec.start = start;
+    rec.duration = duration;
+    rec.window = window;
+    rec.arg = arg;
+    rec.name = name;
+    if (detail) {
+        size_t len = 0;
+        while (len < sizeof(rec.detail) - 1 && detail[len])
+            ++len;
+        // don't cut a multi byte UTF-8 sequence in half
+        if (detail[len]) {
+            while (len > 0 && (static_cast<unsigned char>(detail[len]) & 0xc0) == 0x80)
+                --len;
+        }
+        memcpy(rec.detail, detail, len);
+        rec.detail[len] = '\0';
+    } else {
+        rec.detail[0] = '\0';
+    }
+    mNext = (mNext + 1) % mRecords.size();
+    if (mCount < mRecords.size())
+        ++mCount;
+}
+
+std::string Tracer::json() const
+{
+    auto escape = [](std::ostringstream& out, const char* str) {
+        for (; *str; ++str) {
+            const unsigned char c = *str;
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out << buf;
+            } else {
+                out << c;
+            }
+        }
+    };
+
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::unordered_set<xcb_window_t> windows;
+    bool first = true;
+    const size_t begin = (mNext + mRecords.size() - mCount) % std::max<size_t>(mRecords.size(), 1);
+    for (size_t i = 0; i < mCount; ++i) {
+        const Record& rec = mRecords[(begin + i) % mRecords.size()];
+        if (!first)
+            out << ',';
+        first = false;
+        out << "{\"name\":\"" << rec.name << "\",\"pid\":1,\"tid\":" << rec.window
+            << ",\"ts\":" << rec.start / 1000 << '.' << (rec.start % 1000) / 100;
+        if (rec.duration) {
+            out << ",\"ph\":\"X\",\"dur\":" << rec.duration / 1000 << '.' << (rec.duration % 1000) / 100;
+        } else {
+            out << ",\"ph\":\"i\",\"s\":\"t\"";
+        }
+        out << ",\"args\":{\"arg\":" << rec.arg;
+        if (rec.detail[0]) {
+            out << ",\"detail\":\"";
+            escape(out, rec.detail);
+            out << '"';
+        }
+        out << "}}";
+        windows.insert(rec.window);
+    }
+    for (xcb_window_t win : windows) {
+        if (!first)
+            out << ',';
+        first = false;
+        char name[32];
+        if (win == XCB_WINDOW_NONE)
+            snprintf(name, sizeof(name), "xprop");
+        else
+            snprintf(name, sizeof(name), "window 0x%x", win);
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << win
+            << ",\"args\":{\"name\":\"" << name << "\"}}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+// Runs queued work from the check phase of the event loop, a bounded amount
+// per loop iteration so a burst of maps can't stall the rest of node. An
+// idle handle is kept active while there's work so the loop doesn't block
+// in poll in between.
+class Scheduler
+{
+public:
+    enum Priority { Critical, Normal, Deferrable, PriorityCount };
+    typedef std::function<void()> Unit;
+
+    Scheduler() : mBudget(4000000), mActive(false) {}
+
+    void init(uv_loop_t* loop);
+    void post(Priority priority, Unit&& unit);
+    void drain();
+
+    void setBudget(uint64_t ns) { mBudget = ns; }
+    bool empty() const;
+
+private:
+    bool runOne();
+    static void checkCallback(uv_check_t* handle);
+    static void idleCallback(uv_idle_t*) {}
+
+    std::deque<Unit> mQueues[PriorityCount];
+    uv_check_t mCheck;
+    uv_idle_t mIdle;
+    uint64_t mBudget;       // ns per loop iteration
+    bool mActive;
+};
+
+class Prefetcher;
+
 struct Data
 {
-    Data() : conn(0) { }
+    Data() : conn(0), rootSelected(false), stats(), prefetch(false) { }
 
     void ensure();
+    void updateEventMask();
     template<typename T>
     void forEachScreen(T cb);
     template<typename T>
@@ -83,15 +536,63 @@ struct Data
     xcb_atom_t atom_wm_state;
     std::unordered_set<xcb_window_t> seen;
 
+    // whether SUBSTRUCTURE_NOTIFY is currently selected on the roots
+    bool rootSelected;
+
+    struct Stats
+    {
+        uint64_t wakeups;     // pollCallback invocations
+        uint64_t events;      // events read from the connection
+        uint64_t ignored;     // events we had no use for
+        uint64_t elided;      // requests dropped since they wouldn't change anything
+        uint64_t units;       // scheduler units run
+        uint64_t yields;      // times the scheduler ran out of budget with work left
+    } stats;
+
+    Tracer tracer;
+    Scheduler scheduler;
+
+    // last known server state of windows we write to, used to drop requests
+    // that wouldn't change anything. dropped whenever the top level window
+    // they were written under is mapped, unmapped, reparented or destroyed
+    struct WindowState
+    {
+        WindowState() : geometryMask(0), overrideRedirect(-1) { }
+
+        struct Value
+        {
+            xcb_atom_t type;
+            uint8_t format;
+            std::vector<uint8_t> data;
+        };
+        std::unordered_map<xcb_atom_t, Value> properties;
+
+        uint16_t geometryMask;      // XCB_CONFIG_WINDOW_* bits read from the server
+        int32_t geometry[4];        // x, y, width, height
+        int overrideRedirect;       // -1 if unknown
+    };
+    std::unordered_map<xcb_window_t, WindowState> windowStates;
+    std::unordered_map<xcb_window_t, std::unordered_set<xcb_window_t> > windowStateTops;
+    void trackWindowState(xcb_window_t top, xcb_window_t win);
+    void clearWindowStates(xcb_window_t top);
+
+    // read the current state before the first write to a window
+    bool prefetch;
+
     struct Base
     {
         virtual ~Base() { }
         virtual void run(xcb_window_t win) const = 0;
+        virtual const char* name() const = 0;
+        virtual void prefetch(xcb_window_t, Prefetcher*) const { }
+        virtual Scheduler::Priority priority() const { return Scheduler::Normal; }
     };
 
     struct Property : public Base
     {
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "property"; }
+        virtual void prefetch(xcb_window_t win, Prefetcher* prefetcher) const override;
 
         uint8_t mode;
         xcb_atom_t property, type;
@@ -102,33 +603,42 @@ struct Data
     struct Mapper : public Base
     {
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "map"; }
     };
 
     struct Unmapper : public Base
     {
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "unmap"; }
     };
 
     struct Remapper : public Base
     {
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "remap"; }
+        virtual Scheduler::Priority priority() const override { return Scheduler::Deferrable; }
     };
 
     struct PropertyClearer : public Base
     {
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "clear"; }
+        virtual Scheduler::Priority priority() const override { return Scheduler::Deferrable; }
     };
 
     struct Configurer : public Base
     {
-        Configurer(uint32_t xv, uint32_t yv, uint32_t widthv, uint32_t heightv)
-            : x(xv), y(yv), width(widthv), height(heightv)
+        Configurer(uint16_t maskv, uint32_t xv, uint32_t yv, uint32_t widthv, uint32_t heightv)
+            : mask(maskv), x(xv), y(yv), width(widthv), height(heightv)
         {
         }
 
+        uint16_t mask;  // XCB_CONFIG_WINDOW_* bits that were specified
         uint32_t x, y, width, height;
 
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "configure"; }
+        virtual void prefetch(xcb_window_t win, Prefetcher* prefetcher) const override;
     };
 
     struct Overrider : public Base
@@ -138,6 +648,9 @@ struct Data
         bool on;
 
         virtual void run(xcb_window_t win) const override;
+        virtual const char* name() const override { return "override_redirect"; }
+        virtual Scheduler::Priority priority() const override { return Scheduler::Critical; }
+        virtual void prefetch(xcb_window_t win, Prefetcher* prefetcher) const override;
     };
 
     struct Pending
@@ -147,16 +660,120 @@ struct Data
     };
     std::vector<std::pair<uint64_t, std::vector<Pending> > > pendingProperties;
 
-    static bool baseFromValue(const v8::Local<v8::Value>& val, std::shared_ptr<Base>* base);
     std::unordered_map<std::vector<std::string>, std::vector<std::shared_ptr<Base> > > classProperties;
 
+    void processEvents();
     static void pollCallback(uv_poll_t* handle, int status, int events);
 } data;
 
+void Scheduler::init(uv_loop_t* loop)
+{
+    uv_check_init(loop, &mCheck);
+    uv_idle_init(loop, &mIdle);
+}
+
+inline bool Scheduler::empty() const
+{
+    for (int i = 0; i < PriorityCount; ++i) {
+        if (!mQueues[i].empty())
+            return false;
+    }
+    return true;
+}
+
+void Scheduler::post(Priority priority, Unit&& unit)
+{
+    mQueues[priority].push_back(std::move(unit));
+    if (!mActive) {
+        mActive = true;
+        uv_check_start(&mCheck, Scheduler::checkCallback);
+        uv_idle_start(&mIdle, Scheduler::idleCallback);
+    }
+}
+
+bool Scheduler::runOne()
+{
+    for (int i = 0; i < PriorityCount; ++i) {
+        if (!mQueues[i].empty()) {
+            // units may post more work, don't hold on to the queue entry
+            Unit unit = std::move(mQueues[i].front());
+            mQueues[i].pop_front();
+            unit();
+            ++data.stats.units;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::drain()
+{
+    while (runOne()) {
+    }
+}
+
+void Scheduler::checkCallback(uv_check_t*)
+{
+    Scheduler& scheduler = data.scheduler;
+    {
+        Tracer::Span span(data.tracer, "schedule");
+        // always make some progress, even with a tiny budget
+        const uint64_t start = uv_hrtime();
+        while (scheduler.runOne()) {
+            if (uv_hrtime() - start >= scheduler.mBudget) {
+                if (!scheduler.empty())
+                    ++data.stats.yields;
+                break;
+            }
+        }
+    }
+    // pick up events the units' round trips read off the socket
+    data.processEvents();
+    if (scheduler.empty()) {
+        scheduler.mActive = false;
+        uv_check_stop(&scheduler.mCheck);
+        uv_idle_stop(&scheduler.mIdle);
+    }
+}
+
 void Data::Property::run(xcb_window_t win) const
 {
     // printf("prop change\n");
-    xcb_change_property(::data.conn, mode, win, property, type, format, (data.size() * 8) / format, &data[0]);
+    const uint32_t len = (data.size() * 8) / format;
+    const auto end = data.begin() + (len * format) / 8;
+    auto& known = ::data.windowStates[win].properties;
+    if (mode == XCB_PROP_MODE_REPLACE) {
+        auto it = known.find(property);
+        if (it != known.end() && it->second.type == type && it->second.format == format
+            && it->second.data.size() == static_cast<size_t>(end - data.begin())
+            && std::equal(data.begin(), end, it->second.data.begin())) {
+            ++::data.stats.elided;
+            return;
+        }
+        known[property] = WindowState::Value{ type, format, std::vector<uint8_t>(data.begin(), end) };
+    } else {
+        // we don't know what we're prepending/appending to
+        known.erase(property);
+    }
+    xcb_change_property(::data.conn, mode, win, property, type, format, len, &data[0]);
+}
+
+void Data::trackWindowState(xcb_window_t top, xcb_window_t win)
+{
+    if (win != top)
+        windowStateTops[top].insert(win);
+}
+
+void Data::clearWindowStates(xcb_window_t top)
+{
+    windowStates.erase(top);
+    auto it = windowStateTops.find(top);
+    if (it == windowStateTops.end())
+        return;
+    for (xcb_window_t win : it->second) {
+        windowStates.erase(win);
+    }
+    windowStateTops.erase(it);
 }
 
 void Data::Mapper::run(xcb_window_t win) const
@@ -187,17 +804,40 @@ void Data::Remapper::run(xcb_window_t win) const
 
 void Data::Configurer::run(xcb_window_t win) const
 {
-    uint32_t values[4] = { x, y, width, height };
-    xcb_configure_window(data.conn, win, XCB_CONFIG_WINDOW_X
-                         | XCB_CONFIG_WINDOW_Y
-                         | XCB_CONFIG_WINDOW_WIDTH
-                         | XCB_CONFIG_WINDOW_HEIGHT,
-                         values);
+    // only send the fields that were specified and aren't already set. the
+    // geometry is only known from get_geometry, a window manager may refuse
+    // or change a configure request so anything we send becomes unknown
+    auto& state = data.windowStates[win];
+    const uint32_t all[4] = { x, y, width, height };
+    uint32_t values[4];
+    uint16_t send = 0;
+    int num = 0;
+    for (int i = 0; i < 4; ++i) {
+        const uint16_t field = 1 << i;
+        if (!(mask & field))
+            continue;
+        if ((state.geometryMask & field) && state.geometry[i] == static_cast<int32_t>(all[i]))
+            continue;
+        send |= field;
+        values[num++] = all[i];
+    }
+    if (!send) {
+        ++data.stats.elided;
+        return;
+    }
+    state.geometryMask &= ~send;
+    xcb_configure_window(data.conn, win, send, values);
     xcb_flush(data.conn);
 }
 
 void Data::Overrider::run(xcb_window_t win) const
 {
+    auto& state = data.windowStates[win];
+    if (state.overrideRedirect == (on ? 1 : 0)) {
+        ++data.stats.elided;
+        return;
+    }
+    state.overrideRedirect = on ? 1 : 0;
     uint32_t value[] = { on ? 1u : 0u };
     xcb_change_window_attributes(data.conn, win, XCB_CW_OVERRIDE_REDIRECT, value);
     xcb_flush(data.conn);
@@ -230,6 +870,119 @@ void Data::PropertyClearer::run(xcb_window_t win) const
     }
 
     free(listReply);
+
+    auto state = data.windowStates.find(win);
+    if (state != data.windowStates.end())
+        state->second.properties.clear();
+}
+
+// Pipelines reads of the current state of everything we're about to write so
+// the first write to a window can be elided as well
+class Prefetcher
+{
+public:
+    Prefetcher() {}
+    ~Prefetcher() {}
+
+    void property(xcb_window_t win, xcb_atom_t atom, uint32_t length);
+    void geometry(xcb_window_t win);
+    void attributes(xcb_window_t win);
+
+    void finish();
+
+private:
+    struct PropertyRequest
+    {
+        xcb_window_t window;
+        xcb_atom_t atom;
+        xcb_get_property_cookie_t cookie;
+    };
+    std::vector<PropertyRequest> mProperties;
+    std::unordered_set<uint64_t> mRequested;
+    std::unordered_map<xcb_window_t, xcb_get_geometry_cookie_t> mGeometries;
+    std::unordered_map<xcb_window_t, xcb_get_window_attributes_cookie_t> mAttributes;
+};
+
+void Prefetcher::property(xcb_window_t win, xcb_atom_t atom, uint32_t length)
+{
+    auto state = data.windowStates.find(win);
+    if (state != data.windowStates.end() && state->second.properties.count(atom))
+        return;
+    if (!mRequested.insert((static_cast<uint64_t>(atom) << 32) | win).second)
+        return;
+    // ask for one more word than we'd write, a longer value can't be equal
+    const uint32_t words = (length + 3) / 4 + 1;
+    mProperties.push_back(PropertyRequest{ win, atom, xcb_get_property(data.conn, 0, win, atom, XCB_GET_PROPERTY_TYPE_ANY, 0, words) });
+}
+
+void Prefetcher::geometry(xcb_window_t win)
+{
+    auto state = data.windowStates.find(win);
+    if (state != data.windowStates.end() && state->second.geometryMask == 0xf)
+        return;
+    if (mGeometries.find(win) == mGeometries.end())
+        mGeometries[win] = xcb_get_geometry(data.conn, win);
+}
+
+void Prefetcher::attributes(xcb_window_t win)
+{
+    auto state = data.windowStates.find(win);
+    if (state != data.windowStates.end() && state->second.overrideRedirect != -1)
+        return;
+    if (mAttributes.find(win) == mAttributes.end())
+        mAttributes[win] = xcb_get_window_attributes(data.conn, win);
+}
+
+void Prefetcher::finish()
+{
+    for (const auto& req : mProperties) {
+        xcb_get_property_reply_t* reply = xcb_get_property_reply(data.conn, req.cookie, nullptr);
+        if (!reply)
+            continue;
+        if (reply->type != XCB_ATOM_NONE && !reply->bytes_after) {
+            const uint8_t* value = static_cast<const uint8_t*>(xcb_get_property_value(reply));
+            data.windowStates[req.window].properties[req.atom] =
+                Data::WindowState::Value{ reply->type, reply->format,
+                                          std::vector<uint8_t>(value, value + xcb_get_property_value_length(reply)) };
+        }
+        free(reply);
+    }
+    for (const auto& req : mGeometries) {
+        xcb_get_geometry_reply_t* reply = xcb_get_geometry_reply(data.conn, req.second, nullptr);
+        if (!reply)
+            continue;
+        auto& state = data.windowStates[req.first];
+        state.geometryMask = 0xf;
+        state.geometry[0] = reply->x;
+        state.geometry[1] = reply->y;
+        state.geometry[2] = reply->width;
+        state.geometry[3] = reply->height;
+        free(reply);
+    }
+    for (const auto& req : mAttributes) {
+        xcb_get_window_attributes_reply_t* reply = xcb_get_window_attributes_reply(data.conn, req.second, nullptr);
+        if (!reply)
+            continue;
+        data.windowStates[req.first].overrideRedirect = reply->override_redirect ? 1 : 0;
+        free(reply);
+    }
+}
+
+void Data::Property::prefetch(xcb_window_t win, Prefetcher* prefetcher) const
+{
+    if (mode == XCB_PROP_MODE_REPLACE)
+        prefetcher->property(win, property, data.size());
+}
+
+void Data::Configurer::prefetch(xcb_window_t win, Prefetcher* prefetcher) const
+{
+    if (mask)
+        prefetcher->geometry(win);
+}
+
+void Data::Overrider::prefetch(xcb_window_t win, Prefetcher* prefetcher) const
+{
+    prefetcher->attributes(win);
 }
 
 class Changer
@@ -239,7 +992,7 @@ public:
     ~Changer() {}
 
     void change(xcb_window_t win, const std::shared_ptr<Data::Base>& b);
-    void finish() { xcb_flush(data.conn); }
+    void finish();
 
 private:
     size_t mOffset;
@@ -249,13 +1002,47 @@ void Changer::change(xcb_window_t win, const std::shared_ptr<Data::Base>& b)
 {
     if (mOffset >= data.pendingProperties.size()) {
         // printf("changing...\n");
+        Tracer::Span span(data.tracer, b->name(), win);
         b->run(win);
     } else {
         // printf("postponing change\n");
+        data.tracer.instant("postpone", win, 0, b->name());
         data.pendingProperties.back().second.push_back(Data::Pending{ win, b });
     }
 }
 
+void Changer::finish()
+{
+    Tracer::Span span(data.tracer, "flush");
+    xcb_flush(data.conn);
+}
+
+// Queues actions to be run together and in order. Anything following a
+// map/unmap in the batch is postponed until that has been seen.
+// top is the top level window the batch was triggered by, any state
+// recorded for the batch's windows is dropped along with it
+static void scheduleBatch(Scheduler::Priority priority, xcb_window_t top, const std::vector<Data::Pending>& batch)
+{
+    data.scheduler.post(priority, [top, batch]() {
+            // read the current state right before writing, the batch may
+            // have waited a while in the queue
+            if (data.prefetch) {
+                Prefetcher prefetcher;
+                for (const auto& item : batch) {
+                    item.base->prefetch(item.window, &prefetcher);
+                }
+                prefetcher.finish();
+            }
+
+            Changer changer(data.pendingProperties.size());
+            for (const auto& item : batch) {
+                changer.change(item.window, item.base);
+                data.trackWindowState(top, item.window);
+            }
+            changer.finish();
+        });
+}
+
 class Traverser
 {
 public:
@@ -267,8 +1054,12 @@ public:
     bool hasMore() const { return !mCookies.empty(); }
     void run();
 
+    // run one level per scheduler unit until done
+    static void schedule(const std::shared_ptr<Traverser>& traverser);
+
 private:
     std::unordered_map<xcb_window_t, xcb_get_property_cookie_t> mCookies;
+    std::unordered_map<xcb_window_t, xcb_window_t> mTops;
     std::vector<std::vector<std::string> > mMatches;
     uint32_t mLevel;
 };
@@ -286,17 +1077,27 @@ void Traverser::traverse(xcb_window_t win)
 {
     auto cookie = xcb_icccm_get_wm_class(data.conn, win);
     mCookies[win] = cookie;
+    mTops[win] = win;
 }
 
 void Traverser::run()
 {
+    Tracer::Span span(data.tracer, "traverse", XCB_WINDOW_NONE, mLevel);
     std::unordered_map<xcb_window_t, xcb_get_property_cookie_t> newCookies;
-    Changer changer;
+    std::unordered_map<xcb_window_t, xcb_window_t> newTops;
+    struct Match
+    {
+        xcb_window_t window, top;
+        const std::vector<std::shared_ptr<Data::Base> >* bases;
+    };
+    std::vector<Match> matched;
 
     std::vector<uint32_t> hasmatch;
     xcb_icccm_get_wm_class_reply_t wmclass;
     for (const auto& cookie : mCookies) {
+        const xcb_window_t top = mTops[cookie.first];
         if (xcb_icccm_get_wm_class_reply(data.conn, cookie.second, &wmclass, nullptr)) {
+            data.tracer.instant("wm_class", cookie.first, mLevel, wmclass.class_name);
              // printf("matching %s(%u) vs %zu candidates\n", wmclass.class_name, mLevel, mMatches.size());
             // check if we match any of the items in the level
             auto begin = mMatches.begin();
@@ -309,18 +1110,18 @@ void Traverser::run()
                     // if we've matched everything, query children
                     if (it->size() == mLevel + 1) {
                         // printf("matched full thingy\n");
+                        data.tracer.instant("match", cookie.first, mLevel, wmclass.class_name);
                         auto prop = data.classProperties.find(*it);
                         assert(prop != data.classProperties.end());
-                        const auto& vec = prop->second;
-                        for (const auto& base : vec) {
-                            changer.change(cookie.first, base);
-                        }
+                        matched.push_back(Match{ cookie.first, top, &prop->second });
                     } else {
                         // printf("matched sub, querying children\n");
+                        data.tracer.instant("descend", cookie.first, mLevel, wmclass.class_name);
                         // start the next property run
-                        data.forEachWindow(cookie.first, [&newCookies](xcb_connection_t* conn, xcb_window_t win) {
+                        data.forEachWindow(cookie.first, [&newCookies, &newTops, top](xcb_connection_t* conn, xcb_window_t win) {
                                 auto cookie = xcb_icccm_get_wm_class(conn, win);
                                 newCookies[win] = cookie;
+                                newTops[win] = top;
                             });
                     }
                 // } else {
@@ -331,7 +1132,17 @@ void Traverser::run()
             xcb_icccm_get_wm_class_reply_wipe(&wmclass);
         }
     }
-    changer.finish();
+
+    for (const auto& match : matched) {
+        std::vector<Data::Pending> batch;
+        Scheduler::Priority priority = Scheduler::PriorityCount;
+        for (const auto& base : *match.bases) {
+            batch.push_back(Data::Pending{ match.window, base });
+            priority = std::min(priority, base->priority());
+        }
+        if (!batch.empty())
+            scheduleBatch(priority, match.top, batch);
+    }
 
     std::sort(hasmatch.begin(), hasmatch.end());
     // take out all non-matches
@@ -350,9 +1161,19 @@ void Traverser::run()
 
     ++mLevel;
     std::swap(mCookies, newCookies);
+    std::swap(mTops, newTops);
     // printf("got %lu children for level %d\n", mCookies.size(), mLevel);
 }
 
+void Traverser::schedule(const std::shared_ptr<Traverser>& traverser)
+{
+    data.scheduler.post(Scheduler::Normal, [traverser]() {
+            traverser->run();
+            if (traverser->hasMore())
+                Traverser::schedule(traverser);
+        });
+}
+
 template<typename T>
 inline void Data::forEachScreen(T cb)
 {
@@ -386,14 +1207,7 @@ void Data::ensure()
     if (conn)
         return;
     conn = xcb_connect(NULL, &screenCount);
-    data.forEachScreen([](xcb_connection_t* conn, xcb_screen_t* screen) {
-            xcb_window_t root = screen->root;
-            // printf("setting up on root %d\n", screen->root);
-            uint32_t mask = XCB_CW_EVENT_MASK;
-            uint32_t values[2] = { XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY, 0 };
-            xcb_change_window_attributes_checked(conn, root, mask, values);
-            xcb_flush(conn);
-        });
+    // root event selection is deferred to updateEventMask()
 
     xcb_intern_atom_cookie_t cookie = xcb_intern_atom(conn, 0, 8, "WM_STATE");
     xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(conn, cookie, nullptr);
@@ -408,56 +1222,85 @@ void Data::ensure()
     poller.data = 0;
     uv_poll_init(uv_default_loop(), &poller, fd);
     uv_poll_start(&poller, UV_READABLE, Data::pollCallback);
+    scheduler.init(uv_default_loop());
     // printf("setup xcb listener\n");
 }
 
+void Data::updateEventMask()
+{
+    // SUBSTRUCTURE_NOTIFY on the roots wakes us up for every configure,
+    // circulate and gravity event on the display, don't ask for it until
+    // the first rule is registered. rules are never removed so once
+    // selected it stays selected
+    if (rootSelected || classProperties.empty())
+        return;
+    rootSelected = true;
+    forEachScreen([](xcb_connection_t* conn, xcb_screen_t* screen) {
+            // printf("selecting root %d\n", screen->root);
+            uint32_t values[] = { XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY };
+            xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK, values);
+        });
+    xcb_flush(conn);
+}
+
 void Data::pollCallback(uv_poll_t* handle, int status, int events)
+{
+    ++data.stats.wakeups;
+    data.processEvents();
+}
+
+// Handles everything that's been read from the connection so far. Round
+// trips made outside of this (by scheduler units) can pull events off the
+// socket into xcb's queue without uv_poll ever seeing them, so this needs
+// to run after those as well.
+void Data::processEvents()
 {
     auto change = [](uint32_t type, xcb_window_t window) -> xcb_window_t {
         std::vector<uint64_t> keys;
         xcb_window_t real = XCB_WINDOW_NONE;
         keys.push_back((static_cast<uint64_t>(type) << 32) | window);
+        // the window manager is likely to touch windows around a map/unmap
+        data.clearWindowStates(window);
         data.forEachWindow(window, [&keys, &real, type](xcb_connection_t*, xcb_window_t win) {
                 keys.push_back((static_cast<uint64_t>(type) << 32) | win);
+                data.clearWindowStates(win);
                 if (real == XCB_WINDOW_NONE)
                     real = win;
             });
         if (real == XCB_WINDOW_NONE)
             real = window;
-        Changer changer(1);
         for (size_t i = 0; i < data.pendingProperties.size(); ++i) {
             const auto& p = data.pendingProperties[i];
             if (std::find(keys.begin(), keys.end(), p.first) != keys.end()) {
-                for (const auto& item : p.second) {
-                    changer.change(item.window, item.base);
-                }
+                // the window is waiting on these, they go before anything else
+                scheduleBatch(Scheduler::Critical, window, p.second);
                 data.pendingProperties.erase(data.pendingProperties.begin() + i);
                 break;
             }
         }
-        changer.finish();
         return real;
     };
 
     xcb_generic_event_t* event;
-    while ((event = xcb_poll_for_event(data.conn))) {
+    while ((event = xcb_poll_for_event(conn))) {
+        ++data.stats.events;
         const auto eventType = event->response_type & ~0x80;
         if (eventType == XCB_MAP_NOTIFY) {
             // see if we have any pending changes for our window
             xcb_map_notify_event_t* mapEvent = reinterpret_cast<xcb_map_notify_event_t*>(event);
+            data.tracer.instant("MapNotify", mapEvent->window);
             const xcb_window_t real = change(XCB_MAP_NOTIFY, mapEvent->window);
 
             if (data.seen.find(real) == data.seen.end()) {
-                Traverser traverser;
-                traverser.traverse(mapEvent->window);
-                while (traverser.hasMore()) {
-                    traverser.run();
-                }
+                std::shared_ptr<Traverser> traverser = std::make_shared<Traverser>();
+                traverser->traverse(mapEvent->window);
+                Traverser::schedule(traverser);
                 data.seen.insert(real);
             }
         } else if (eventType == XCB_UNMAP_NOTIFY) {
             // see if we have any pending changes for our window
             xcb_unmap_notify_event_t* unmapEvent = reinterpret_cast<xcb_unmap_notify_event_t*>(event);
+            data.tracer.instant("UnmapNotify", unmapEvent->window);
             change(XCB_UNMAP_NOTIFY, unmapEvent->window);
         } else if (eventType == XCB_REPARENT_NOTIFY) {
             // reparent might mean unmap?
@@ -465,203 +1308,710 @@ void Data::pollCallback(uv_poll_t* handle, int status, int events)
 
             // see if we have any pending changes for our window
             xcb_reparent_notify_event_t* reparentEvent = reinterpret_cast<xcb_reparent_notify_event_t*>(event);
+            data.tracer.instant("ReparentNotify", reparentEvent->window, reparentEvent->parent);
             change(XCB_UNMAP_NOTIFY, reparentEvent->window);
         } else if (eventType == XCB_DESTROY_NOTIFY) {
             xcb_destroy_notify_event_t* destroyEvent = reinterpret_cast<xcb_destroy_notify_event_t*>(event);
+            data.tracer.instant("DestroyNotify", destroyEvent->window);
             data.seen.erase(destroyEvent->window);
+            data.clearWindowStates(destroyEvent->window);
+        } else {
+            data.tracer.instant("event", XCB_WINDOW_NONE, eventType);
+            ++data.stats.ignored;
         }
         // printf("got event %d\n", eventType);
         free(event);
     }
+    updateEventMask();
 }
 
-bool Data::baseFromValue(const v8::Local<v8::Value>& val, std::shared_ptr<Base>* base)
+// On-disk layout written by SnapshotWriter. Everything is native endian and
+// 4 byte aligned so the file can be mmap'ed and used in place:
+//
+//   SnapshotHeader
+//   SnapshotAtom[atomCount]
+//   SnapshotWindow[windowCount]          sorted by window id
+//   SnapshotProperty[propertyCount]
+//   string table[stringsSize]            uint32_t length + bytes, padded to 4
+//
+// Strings and property values are offsets into the string table, identical
+// values are only stored once.
+struct SnapshotHeader
 {
-    if (val->IsObject()) {
-        Nan::HandleScope scope;
-        auto ctx = Nan::GetCurrentContext();
+    char magic[4];
+    uint32_t version;
+    uint64_t time;
+    uint32_t atomCount, windowCount, propertyCount, stringsSize;
+};
 
-        v8::Local<v8::Object> obj = v8::Local<v8::Object>::Cast(val);
+struct SnapshotAtom
+{
+    uint32_t atom, name;
+};
 
-        auto whatStr = Nan::New("what").ToLocalChecked();
-        if (!obj->Has(whatStr)) {
-            Nan::ThrowError("Needs a what");
-            return false;
+struct SnapshotWindow
+{
+    uint32_t window, parent, instanceName, className, firstProperty, propertyCount;
+};
+
+struct SnapshotProperty
+{
+    uint32_t atom, type, format, value;
+};
+
+static const char snapshotMagic[4] = { 'X', 'P', 'S', 'N' };
+static const uint32_t snapshotVersion = 1;
+static const uint32_t snapshotNoString = 0xffffffff;
+
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::vector<xcb_atom_t>& atoms) : mAtoms(atoms) {}
+    ~SnapshotWriter() {}
+
+    void collect();
+    bool write(const std::string& path, std::string* error) const;
+
+private:
+    uint32_t string(const char* str, size_t len);
+
+    std::vector<xcb_atom_t> mAtoms;
+    std::vector<SnapshotAtom> mAtomNames;
+    std::vector<SnapshotWindow> mWindows;
+    std::vector<SnapshotProperty> mProperties;
+    std::string mStrings;
+    std::unordered_map<std::string, uint32_t> mStringOffsets;
+};
+
+uint32_t SnapshotWriter::string(const char* str, size_t len)
+{
+    std::string key(str, len);
+    auto it = mStringOffsets.find(key);
+    if (it != mStringOffsets.end())
+        return it->second;
+    const uint32_t off = mStrings.size();
+    const uint32_t len32 = len;
+    mStrings.append(reinterpret_cast<const char*>(&len32), sizeof(len32));
+    mStrings.append(str, len);
+    mStrings.resize((mStrings.size() + 3) & ~static_cast<size_t>(3), '\0');
+    mStringOffsets[std::move(key)] = off;
+    return off;
+}
+
+void SnapshotWriter::collect()
+{
+    struct Request
+    {
+        Request(xcb_window_t w, xcb_window_t p)
+            : window(w), parent(p), tree(), cls()
+        {
         }
 
-        const std::string what = std::string(*v8::String::Utf8Value(obj->Get(ctx, whatStr).ToLocalChecked()));
-        if (what == "override_redirect") {
-            auto onStr = Nan::New("on").ToLocalChecked();
-            if (!obj->Has(onStr)) {
-                Nan::ThrowError("Needs at least on");
-                return false;
+        xcb_window_t window, parent;
+        xcb_query_tree_cookie_t tree;
+        xcb_get_property_cookie_t cls;
+        std::vector<xcb_get_property_cookie_t> props;
+    };
+
+    std::vector<xcb_get_atom_name_cookie_t> nameCookies;
+    for (xcb_atom_t atom : mAtoms) {
+        nameCookies.push_back(xcb_get_atom_name(data.conn, atom));
+    }
+
+    // only grab while reading the tree, writing the file happens without it
+    GrabServer grab(data.conn);
+
+    std::vector<Request> level;
+    data.forEachScreen([&level](xcb_connection_t*, xcb_screen_t* screen) {
+            level.push_back(Request(screen->root, XCB_WINDOW_NONE));
+        });
+
+    // one round trip per tree level, every request for a level is in flight at once
+    while (!level.empty()) {
+        for (auto& req : level) {
+            req.tree = xcb_query_tree(data.conn, req.window);
+            req.cls = xcb_icccm_get_wm_class(data.conn, req.window);
+            for (xcb_atom_t atom : mAtoms) {
+                req.props.push_back(xcb_get_property(data.conn, 0, req.window, atom, XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX / 4));
             }
-            const bool on = v8::Local<v8::Boolean>::Cast(obj->Get(ctx, onStr).ToLocalChecked())->Value();
-            *base = std::make_shared<Overrider>(on);
-            return true;
-        } else if (what == "property") {
-            // property?
+        }
 
-            std::shared_ptr<Property> prop = std::make_shared<Property>();
+        std::vector<Request> next;
+        for (auto& req : level) {
+            SnapshotWindow win = { req.window, req.parent, snapshotNoString, snapshotNoString,
+                                   static_cast<uint32_t>(mProperties.size()), 0 };
 
-            auto atom = [](const v8::Local<v8::Value>& val) -> xcb_atom_t {
-                if (val->IsNumber()) {
-                    return v8::Local<v8::Int32>::Cast(val)->Value();
-                } else {
-                    v8::String::Utf8Value str(val);
-                    xcb_intern_atom_cookie_t cookie = xcb_intern_atom(data.conn, 0, str.length(), *str);
-                    xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(data.conn, cookie, nullptr);
-                    xcb_atom_t atom = XCB_ATOM_NONE;
-                    if (reply) {
-                        atom = reply->atom;
-                        free(reply);
-                    }
-                    return atom;
+            xcb_icccm_get_wm_class_reply_t wmclass;
+            if (xcb_icccm_get_wm_class_reply(data.conn, req.cls, &wmclass, nullptr)) {
+                win.instanceName = string(wmclass.instance_name, strlen(wmclass.instance_name));
+                win.className = string(wmclass.class_name, strlen(wmclass.class_name));
+                xcb_icccm_get_wm_class_reply_wipe(&wmclass);
+            }
+
+            for (size_t i = 0; i < req.props.size(); ++i) {
+                xcb_get_property_reply_t* reply = xcb_get_property_reply(data.conn, req.props[i], nullptr);
+                if (!reply)
+                    continue;
+                if (reply->type != XCB_ATOM_NONE) {
+                    const char* value = static_cast<const char*>(xcb_get_property_value(reply));
+                    mProperties.push_back(SnapshotProperty{ mAtoms[i], reply->type, reply->format,
+                                                            string(value, xcb_get_property_value_length(reply)) });
+                    ++win.propertyCount;
                 }
-            };
+                free(reply);
+            }
+
+            xcb_query_tree_reply_t* tree = xcb_query_tree_reply(data.conn, req.tree, nullptr);
+            if (tree) {
+                const int num = xcb_query_tree_children_length(tree);
+                const xcb_window_t* children = xcb_query_tree_children(tree);
+                for (int i = 0; i < num; ++i) {
+                    next.push_back(Request(children[i], req.window));
+                }
+                free(tree);
+            }
+
+            mWindows.push_back(win);
+        }
+        std::swap(level, next);
+    }
+
+    for (size_t i = 0; i < nameCookies.size(); ++i) {
+        uint32_t name = snapshotNoString;
+        xcb_get_atom_name_reply_t* reply = xcb_get_atom_name_reply(data.conn, nameCookies[i], nullptr);
+        if (reply) {
+            name = string(xcb_get_atom_name_name(reply), xcb_get_atom_name_name_length(reply));
+            free(reply);
+        }
+        mAtomNames.push_back(SnapshotAtom{ mAtoms[i], name });
+    }
+
+    std::sort(mWindows.begin(), mWindows.end(), [](const SnapshotWindow& a, const SnapshotWindow& b) {
+            return a.window < b.window;
+        });
+}
+
+bool SnapshotWriter::write(const std::string& path, std::string* error) const
+{
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        *error = "Unable to open " + path + ": " + strerror(errno);
+        return false;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.atomCount = mAtomNames.size();
+    header.windowCount = mWindows.size();
+    header.propertyCount = mProperties.size();
+    header.stringsSize = mStrings.size();
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(mAtomNames.data(), sizeof(SnapshotAtom), mAtomNames.size(), f);
+    fwrite(mWindows.data(), sizeof(SnapshotWindow), mWindows.size(), f);
+    fwrite(mProperties.data(), sizeof(SnapshotProperty), mProperties.size(), f);
+    fwrite(mStrings.data(), 1, mStrings.size(), f);
+
+    const bool failed = ferror(f) != 0;
+    if (fclose(f) != 0 || failed) {
+        *error = "Unable to write " + path + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+class SnapshotReader
+{
+public:
+    SnapshotReader() : mData(nullptr), mSize(0) {}
+    ~SnapshotReader();
+
+    bool open(const std::string& path, std::string* error);
+
+    const SnapshotHeader* header() const { return reinterpret_cast<const SnapshotHeader*>(mData); }
+    const SnapshotAtom* atoms() const { return reinterpret_cast<const SnapshotAtom*>(mData + sizeof(SnapshotHeader)); }
+    const SnapshotWindow* windows() const;
+    const SnapshotProperty* properties() const;
+
+    bool sameString(uint32_t off, const SnapshotReader& other, uint32_t otherOff) const;
+    // atoms captured by both snapshots, only those are compared
+    std::unordered_set<uint32_t> sharedAtoms(const SnapshotReader& other) const;
+    bool sameWindow(const SnapshotWindow& win, const SnapshotReader& other, const SnapshotWindow& otherWin,
+                    const std::unordered_set<uint32_t>& shared) const;
+
+private:
+    const uint8_t* mData;
+    size_t mSize;
+};
 
-            auto modeStr = Nan::New("mode").ToLocalChecked();
-            auto propertyStr = Nan::New("property").ToLocalChecked();
-            auto typeStr = Nan::New("type").ToLocalChecked();
-            auto formatStr = Nan::New("format").ToLocalChecked();
-            auto dataStr = Nan::New("data").ToLocalChecked();
+SnapshotReader::~SnapshotReader()
+{
+    if (mData)
+        munmap(const_cast<uint8_t*>(mData), mSize);
+}
+
+bool SnapshotReader::open(const std::string& path, std::string* error)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        *error = "Unable to open " + path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        *error = "Invalid snapshot " + path;
+        ::close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        *error = "Unable to map " + path + ": " + strerror(errno);
+        return false;
+    }
+    mData = static_cast<const uint8_t*>(ptr);
+    mSize = st.st_size;
+
+    const SnapshotHeader* h = header();
+    const uint64_t expected = sizeof(SnapshotHeader)
+        + static_cast<uint64_t>(h->atomCount) * sizeof(SnapshotAtom)
+        + static_cast<uint64_t>(h->windowCount) * sizeof(SnapshotWindow)
+        + static_cast<uint64_t>(h->propertyCount) * sizeof(SnapshotProperty)
+        + h->stringsSize;
+    if (memcmp(h->magic, snapshotMagic, sizeof(h->magic)) || h->version != snapshotVersion || expected != mSize) {
+        *error = "Invalid snapshot " + path;
+        return false;
+    }
+    return true;
+}
+
+inline const SnapshotWindow* SnapshotReader::windows() const
+{
+    return reinterpret_cast<const SnapshotWindow*>(mData + sizeof(SnapshotHeader)
+                                                   + header()->atomCount * sizeof(SnapshotAtom));
+}
+
+inline const SnapshotProperty* SnapshotReader::properties() const
+{
+    return reinterpret_cast<const SnapshotProperty*>(windows() + header()->windowCount);
+}
+
+bool SnapshotReader::sameString(uint32_t off, const SnapshotReader& other, uint32_t otherOff) const
+{
+    if (off == snapshotNoString || otherOff == snapshotNoString)
+        return off == otherOff;
+    const uint8_t* strings = reinterpret_cast<const uint8_t*>(properties() + header()->propertyCount);
+    const uint8_t* otherStrings = reinterpret_cast<const uint8_t*>(other.properties() + other.header()->propertyCount);
+    if (off + sizeof(uint32_t) > header()->stringsSize || otherOff + sizeof(uint32_t) > other.header()->stringsSize)
+        return false;
+    uint32_t len, otherLen;
+    memcpy(&len, strings + off, sizeof(len));
+    memcpy(&otherLen, otherStrings + otherOff, sizeof(otherLen));
+    if (len != otherLen
+        || off + sizeof(uint32_t) + len > header()->stringsSize
+        || otherOff + sizeof(uint32_t) + otherLen > other.header()->stringsSize)
+        return false;
+    return !memcmp(strings + off + sizeof(uint32_t), otherStrings + otherOff + sizeof(uint32_t), len);
+}
+
+std::unordered_set<uint32_t> SnapshotReader::sharedAtoms(const SnapshotReader& other) const
+{
+    std::unordered_set<uint32_t> mine, shared;
+    for (uint32_t i = 0; i < header()->atomCount; ++i) {
+        mine.insert(atoms()[i].atom);
+    }
+    for (uint32_t i = 0; i < other.header()->atomCount; ++i) {
+        if (mine.count(other.atoms()[i].atom))
+            shared.insert(other.atoms()[i].atom);
+    }
+    return shared;
+}
+
+bool SnapshotReader::sameWindow(const SnapshotWindow& win, const SnapshotReader& other, const SnapshotWindow& otherWin,
+                                const std::unordered_set<uint32_t>& shared) const
+{
+    if (win.parent != otherWin.parent
+        || !sameString(win.className, other, otherWin.className)
+        || !sameString(win.instanceName, other, otherWin.instanceName))
+        return false;
+    if (static_cast<uint64_t>(win.firstProperty) + win.propertyCount > header()->propertyCount
+        || static_cast<uint64_t>(otherWin.firstProperty) + otherWin.propertyCount > other.header()->propertyCount)
+        return false;
+    // property atoms are server ids, diffing only makes sense within one server lifetime
+    const SnapshotProperty* props = properties() + win.firstProperty;
+    const SnapshotProperty* otherProps = other.properties() + otherWin.firstProperty;
+    uint32_t count = 0, otherCount = 0;
+    for (uint32_t j = 0; j < otherWin.propertyCount; ++j) {
+        if (shared.count(otherProps[j].atom))
+            ++otherCount;
+    }
+    // each atom appears at most once per window
+    for (uint32_t i = 0; i < win.propertyCount; ++i) {
+        if (!shared.count(props[i].atom))
+            continue;
+        ++count;
+        const SnapshotProperty* match = nullptr;
+        for (uint32_t j = 0; j < otherWin.propertyCount; ++j) {
+            if (otherProps[j].atom == props[i].atom) {
+                match = otherProps + j;
+                break;
+            }
+        }
+        if (!match
+            || props[i].type != match->type
+            || props[i].format != match->format
+            || !sameString(props[i].value, other, match->value))
+            return false;
+    }
+    return count == otherCount;
+}
+
+// Builds rules for both forWindow and loadRules. Atom names are collected
+// first so they can be interned in one batch, and errors are collected
+// instead of throwing on the first one.
+class RuleLoader
+{
+public:
+    RuleLoader() {}
+    ~RuleLoader() {}
+
+    bool add(const JsonValue& rule, std::string* error);
+    void load(const JsonValue& rules);
+    void finish();
+
+    const std::vector<std::string>& errors() const { return mErrors; }
+
+private:
+    bool base(const JsonValue& val, std::shared_ptr<Data::Base>* base, std::string* error);
+    bool atom(const JsonValue& val, xcb_atom_t* atom, std::string* error);
+
+    std::vector<std::pair<std::vector<std::string>, std::shared_ptr<Data::Base> > > mRules;
+    std::vector<std::pair<std::string, xcb_atom_t*> > mAtoms;
+    std::vector<std::shared_ptr<Data::Property> > mAtomData;
+    std::vector<std::string> mErrors;
+};
+
+// integral number within [min, max]
+static bool jsonInteger(const JsonValue& val, double min, double max, double* out)
+{
+    if (val.type != JsonValue::Number || !std::isfinite(val.number)
+        || val.number < min || val.number > max || val.number != std::trunc(val.number))
+        return false;
+    *out = val.number;
+    return true;
+}
+
+bool RuleLoader::atom(const JsonValue& val, xcb_atom_t* atom, std::string* error)
+{
+    if (val.type == JsonValue::Number) {
+        double num;
+        if (!jsonInteger(val, 0, UINT32_MAX, &num)) {
+            *error = "Invalid atom";
+            return false;
+        }
+        *atom = static_cast<xcb_atom_t>(num);
+        return true;
+    } else if (val.type == JsonValue::String) {
+        // resolved in finish()
+        *atom = XCB_ATOM_NONE;
+        mAtoms.push_back(std::make_pair(val.string, atom));
+        return true;
+    }
+    *error = "Atom needs to be a number or string";
+    return false;
+}
+
+bool RuleLoader::base(const JsonValue& val, std::shared_ptr<Data::Base>* base, std::string* error)
+{
+    if (val.type == JsonValue::Object) {
+        const JsonValue* what = val.find("what");
+        if (!what || what->type != JsonValue::String) {
+            *error = "Needs a what";
+            return false;
+        }
+
+        if (what->string == "override_redirect") {
+            const JsonValue* on = val.find("on");
+            if (!on) {
+                *error = "Needs at least on";
+                return false;
+            }
+            if (on->type != JsonValue::Bool) {
+                *error = "on needs to be a boolean";
+                return false;
+            }
+            *base = std::make_shared<Data::Overrider>(on->boolean);
+            return true;
+        } else if (what->string == "property") {
+            std::shared_ptr<Data::Property> prop = std::make_shared<Data::Property>();
+
+            const JsonValue* mode = val.find("mode");
+            const JsonValue* property = val.find("property");
+            const JsonValue* type = val.find("type");
+            const JsonValue* format = val.find("format");
+            const JsonValue* dataval = val.find("data");
 
             // required properties
-            if (!obj->Has(propertyStr) || !obj->Has(dataStr)) {
-                Nan::ThrowError("Needs at least property and data");
+            if (!property || !dataval) {
+                *error = "Needs at least property and data";
                 return false;
             }
 
-            if (obj->Has(modeStr)) {
-                prop->mode = v8::Local<v8::Number>::Cast(obj->Get(ctx, modeStr).ToLocalChecked())->Value();
+            if (mode) {
+                double num;
+                if (!jsonInteger(*mode, 0, 255, &num)) {
+                    *error = "Invalid mode";
+                    return false;
+                }
+                prop->mode = static_cast<uint8_t>(num);
                 switch (prop->mode) {
                 case XCB_PROP_MODE_REPLACE:
                 case XCB_PROP_MODE_PREPEND:
                 case XCB_PROP_MODE_APPEND:
                     break;
                 default:
-                    Nan::ThrowError("Invalid mode");
+                    *error = "Invalid mode";
                     return false;
                 }
             } else {
                 prop->mode = XCB_PROP_MODE_REPLACE;
             }
-            prop->property = atom(obj->Get(ctx, propertyStr).ToLocalChecked());
-            if (obj->Has(typeStr)) {
-                prop->type = atom(obj->Get(ctx, typeStr).ToLocalChecked());
+            if (!atom(*property, &prop->property, error))
+                return false;
+            bool isAtom = false;
+            if (type) {
+                if (!atom(*type, &prop->type, error))
+                    return false;
+                isAtom = type->type == JsonValue::String ? type->string == "ATOM" : prop->type == XCB_ATOM_ATOM;
             } else {
                 prop->type = XCB_ATOM_STRING;
             }
-            if (obj->Has(formatStr)) {
-                prop->format = v8::Local<v8::Int32>::Cast(obj->Get(ctx, formatStr).ToLocalChecked())->Value();
+            if (format) {
+                double num;
+                if (!jsonInteger(*format, 0, 255, &num)) {
+                    *error = "Invalid format";
+                    return false;
+                }
+                prop->format = static_cast<uint8_t>(num);
                 switch (prop->format) {
                 case 8:
                 case 16:
                 case 32:
                     break;
                 default:
-                    Nan::ThrowError("Invalid format");
+                    *error = "Invalid format";
                     return false;
                 }
             } else {
                 prop->format = 8;
             }
-            auto dataval = obj->Get(ctx, dataStr).ToLocalChecked();
-            if (node::Buffer::HasInstance(dataval)) {
-                const size_t len = node::Buffer::Length(dataval);
-                const char* ptr = node::Buffer::Data(dataval);
-                prop->data.assign(reinterpret_cast<const uint8_t*>(ptr), reinterpret_cast<const uint8_t*>(ptr) + len);
-            } else {
-                // assume Utf8String
-                v8::String::Utf8Value str(dataval);
-                prop->data.assign(reinterpret_cast<const uint8_t*>(*str), reinterpret_cast<const uint8_t*>(*str) + str.length());
-            }
-            // if type is ATOM then try to internalize the data string
-            if (prop->type == XCB_ATOM_ATOM) {
-                xcb_intern_atom_cookie_t cookie = xcb_intern_atom(data.conn, 0, prop->data.size(), reinterpret_cast<char*>(&prop->data[0]));
-                xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(data.conn, cookie, nullptr);
-                xcb_atom_t atom = XCB_ATOM_NONE;
-                if (reply) {
-                    atom = reply->atom;
-                    free(reply);
+            if (dataval->type == JsonValue::Array) {
+                // binary data, one number per format sized item
+                const double max = (prop->format == 32) ? UINT32_MAX : (1 << prop->format) - 1;
+                const double min = -((max + 1) / 2);
+                for (const auto& item : dataval->array) {
+                    double num;
+                    if (!jsonInteger(item, min, max, &num)) {
+                        *error = "Invalid property data item";
+                        return false;
+                    }
+                    const uint32_t value = static_cast<uint32_t>(static_cast<int64_t>(num));
+                    if (prop->format == 8) {
+                        prop->data.push_back(static_cast<uint8_t>(value));
+                    } else if (prop->format == 16) {
+                        const uint16_t v16 = static_cast<uint16_t>(value);
+                        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&v16);
+                        prop->data.insert(prop->data.end(), bytes, bytes + sizeof(v16));
+                    } else {
+                        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+                        prop->data.insert(prop->data.end(), bytes, bytes + sizeof(value));
+                    }
                 }
-                prop->data.resize(sizeof(xcb_atom_t));
-                memcpy(&prop->data[0], &atom, sizeof(xcb_atom_t));
+                *base = prop;
+                return true;
+            } else if (dataval->type != JsonValue::String) {
+                *error = "Property data needs to be a string or an array of numbers";
+                return false;
             }
+            prop->data.assign(dataval->string.begin(), dataval->string.end());
+            // if type is ATOM then the data string gets internalized in finish()
+            if (isAtom)
+                mAtomData.push_back(prop);
             *base = prop;
             return true;
-        } else if (what == "configure") {
-            auto xStr = Nan::New("x").ToLocalChecked();
-            auto yStr = Nan::New("y").ToLocalChecked();
-            auto widthStr = Nan::New("width").ToLocalChecked();
-            auto heightStr = Nan::New("height").ToLocalChecked();
-
-            uint32_t x = 0, y = 0, w = 0, h = 0;
-            if (obj->Has(xStr)) {
-                x = v8::Local<v8::Uint32>::Cast(obj->Get(ctx, xStr).ToLocalChecked())->Value();
-            }
-            if (obj->Has(yStr)) {
-                y = v8::Local<v8::Uint32>::Cast(obj->Get(ctx, yStr).ToLocalChecked())->Value();
-            }
-            if (obj->Has(widthStr)) {
-                w = v8::Local<v8::Uint32>::Cast(obj->Get(ctx, widthStr).ToLocalChecked())->Value();
-            }
-            if (obj->Has(heightStr)) {
-                h = v8::Local<v8::Uint32>::Cast(obj->Get(ctx, heightStr).ToLocalChecked())->Value();
-            }
-            *base = std::make_shared<Configurer>(x, y, w, h);
+        } else if (what->string == "configure") {
+            uint16_t mask = 0;
+            bool valid = true;
+            auto field = [&val, &mask, &valid, error](const char* name, uint16_t bit, double min, double max) -> uint32_t {
+                const JsonValue* v = val.find(name);
+                if (!v)
+                    return 0;
+                double num;
+                if (!jsonInteger(*v, min, max, &num)) {
+                    if (valid)
+                        *error = std::string("Invalid ") + name;
+                    valid = false;
+                    return 0;
+                }
+                mask |= bit;
+                return static_cast<uint32_t>(static_cast<int64_t>(num));
+            };
+            const uint32_t x = field("x", XCB_CONFIG_WINDOW_X, INT16_MIN, INT16_MAX);
+            const uint32_t y = field("y", XCB_CONFIG_WINDOW_Y, INT16_MIN, INT16_MAX);
+            const uint32_t w = field("width", XCB_CONFIG_WINDOW_WIDTH, 0, UINT16_MAX);
+            const uint32_t h = field("height", XCB_CONFIG_WINDOW_HEIGHT, 0, UINT16_MAX);
+            if (!valid)
+                return false;
+            *base = std::make_shared<Data::Configurer>(mask, x, y, w, h);
             return true;
         } else {
-            Nan::ThrowError("Invalid what");
+            *error = "Invalid what";
             return false;
         }
-    } else if (val->IsString()) {
+    } else if (val.type == JsonValue::String) {
         // runner
-        v8::String::Utf8Value str(val);
-        if (!strncmp(*str, "map", str.length())) {
-            *base = std::make_shared<Mapper>();
+        if (val.string == "map") {
+            *base = std::make_shared<Data::Mapper>();
             return true;
         }
-        if (!strncmp(*str, "unmap", str.length())) {
-            *base = std::make_shared<Unmapper>();
+        if (val.string == "unmap") {
+            *base = std::make_shared<Data::Unmapper>();
             return true;
         }
-        if (!strncmp(*str, "clear", str.length())) {
-            *base = std::make_shared<PropertyClearer>();
+        if (val.string == "clear") {
+            *base = std::make_shared<Data::PropertyClearer>();
             return true;
         }
-        if (!strncmp(*str, "remap", str.length())) {
-            *base = std::make_shared<Remapper>();
+        if (val.string == "remap") {
+            *base = std::make_shared<Data::Remapper>();
             return true;
         }
-        Nan::ThrowError("Unknown data type");
-        return false;
-    } else {
-        Nan::ThrowError("Data needs to be an object or string");
+        *error = "Unknown data type";
         return false;
     }
+    *error = "Data needs to be an object or string";
+    return false;
 }
 
-static void ForWindowClass(const v8::Local<v8::Value>& cls, const v8::Local<v8::Value>& val)
+bool RuleLoader::add(const JsonValue& rule, std::string* error)
 {
-    if (!cls->IsString()) {
-        Nan::ThrowError("Class needs to be a string");
+    const JsonValue* cls = rule.find("class");
+    const JsonValue* dataval = rule.find("data");
+    std::shared_ptr<Data::Base> b;
+    if (rule.type != JsonValue::Object || !cls || !dataval) {
+        *error = "Needs a class and data property";
+    } else if (cls->type != JsonValue::String) {
+        *error = "Class needs to be a string";
+    } else if (base(*dataval, &b, error)) {
+        mRules.push_back(std::make_pair(split(cls->string, '.'), b));
+        return true;
+    }
+    return false;
+}
+
+void RuleLoader::load(const JsonValue& rules)
+{
+    if (rules.type != JsonValue::Array) {
+        mErrors.push_back("Rules need to be an array");
         return;
     }
-    Nan::HandleScope scope;
-    data.ensure();
+    for (size_t i = 0; i < rules.array.size(); ++i) {
+        std::string error;
+        if (!add(rules.array[i], &error))
+            mErrors.push_back("Rule " + std::to_string(i) + ": " + error);
+    }
+}
 
-    const std::string clsstr = *v8::String::Utf8Value(cls);
+// Converts a forWindow argument to the form rule files are parsed into so
+// both go through RuleLoader. Buffers become strings holding the raw bytes.
+static bool jsonFromValue(const v8::Local<v8::Value>& val, JsonValue* json, int depth = 0)
+{
+    if (depth > 64)
+        return false;
+    auto ctx = Nan::GetCurrentContext();
+    if (node::Buffer::HasInstance(val)) {
+        json->type = JsonValue::String;
+        json->string.assign(node::Buffer::Data(val), node::Buffer::Length(val));
+    } else if (val->IsString()) {
+        json->type = JsonValue::String;
+        json->string = *v8::String::Utf8Value(val);
+    } else if (val->IsBoolean()) {
+        json->type = JsonValue::Bool;
+        json->boolean = v8::Local<v8::Boolean>::Cast(val)->Value();
+    } else if (val->IsNumber()) {
+        json->type = JsonValue::Number;
+        json->number = v8::Local<v8::Number>::Cast(val)->Value();
+    } else if (val->IsArray()) {
+        v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(val);
+        json->type = JsonValue::Array;
+        json->array.resize(arr->Length());
+        for (uint32_t i = 0; i < arr->Length(); ++i) {
+            if (!jsonFromValue(arr->Get(ctx, i).ToLocalChecked(), &json->array[i], depth + 1))
+                return false;
+        }
+    } else if (val->IsObject()) {
+        v8::Local<v8::Object> obj = v8::Local<v8::Object>::Cast(val);
+        v8::Local<v8::Array> keys = Nan::GetOwnPropertyNames(obj).ToLocalChecked();
+        json->type = JsonValue::Object;
+        for (uint32_t i = 0; i < keys->Length(); ++i) {
+            auto key = keys->Get(ctx, i).ToLocalChecked();
+            json->object.push_back(std::make_pair(std::string(*v8::String::Utf8Value(key)), JsonValue()));
+            if (!jsonFromValue(obj->Get(ctx, key).ToLocalChecked(), &json->object.back().second, depth + 1))
+                return false;
+        }
+    }
+    return true;
+}
 
-    std::shared_ptr<Data::Base> base;
-    if (!Data::baseFromValue(val, &base))
+void RuleLoader::finish()
+{
+    if (!mErrors.empty())
         return;
-    // if we have an existing window, handle that here
-    data.classProperties[split(clsstr, '.')].push_back(base);
+
+    // one round trip for every atom referenced by the rule set
+    std::unordered_map<std::string, xcb_intern_atom_cookie_t> cookies;
+    for (const auto& prop : mAtomData) {
+        const std::string name(prop->data.begin(), prop->data.end());
+        if (cookies.find(name) == cookies.end())
+            cookies[name] = xcb_intern_atom(data.conn, 0, name.size(), name.c_str());
+    }
+    for (const auto& atom : mAtoms) {
+        if (cookies.find(atom.first) == cookies.end())
+            cookies[atom.first] = xcb_intern_atom(data.conn, 0, atom.first.size(), atom.first.c_str());
+    }
+    std::unordered_map<std::string, xcb_atom_t> atoms;
+    for (const auto& cookie : cookies) {
+        xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(data.conn, cookie.second, nullptr);
+        xcb_atom_t atom = XCB_ATOM_NONE;
+        if (reply) {
+            atom = reply->atom;
+            free(reply);
+        }
+        atoms[cookie.first] = atom;
+    }
+
+    for (const auto& atom : mAtoms) {
+        *atom.second = atoms[atom.first];
+    }
+    for (const auto& prop : mAtomData) {
+        const xcb_atom_t atom = atoms[std::string(prop->data.begin(), prop->data.end())];
+        prop->data.resize(sizeof(xcb_atom_t));
+        memcpy(&prop->data[0], &atom, sizeof(xcb_atom_t));
+    }
+
+    for (auto& rule : mRules) {
+        data.classProperties[std::move(rule.first)].push_back(std::move(rule.second));
+    }
+    mRules.clear();
 }
 
 static void Start(const Nan::FunctionCallbackInfo<v8::Value>& args)
 {
+    data.ensure();
+    data.updateEventMask();
+
     GrabServer grab(data.conn);
     Traverser traverser;
     data.forEachScreen([&traverser](xcb_connection_t*, xcb_screen_t* screen) {
@@ -682,6 +2032,9 @@ static void Start(const Nan::FunctionCallbackInfo<v8::Value>& args)
     while (traverser.hasMore()) {
         traverser.run();
     }
+    // apply what matched while we still hold the grab
+    data.scheduler.drain();
+    data.processEvents();
 }
 
 static void ForWindow(const Nan::FunctionCallbackInfo<v8::Value>& args)
@@ -690,17 +2043,252 @@ static void ForWindow(const Nan::FunctionCallbackInfo<v8::Value>& args)
         Nan::ThrowError("Needs one argument of type object");
         return;
     }
+    Nan::HandleScope scope;
+    data.ensure();
+
+    JsonValue rule;
+    if (!jsonFromValue(args[0], &rule)) {
+        Nan::ThrowError("Rule nested too deep");
+        return;
+    }
+
+    RuleLoader loader;
+    std::string error;
+    if (!loader.add(rule, &error)) {
+        Nan::ThrowError(error.c_str());
+        return;
+    }
+    loader.finish();
+    data.updateEventMask();
+    // interning may have queued events uv_poll won't tell us about
+    data.processEvents();
+}
+
+static void LoadRules(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 1 || (!args[0]->IsString() && !node::Buffer::HasInstance(args[0]))) {
+        Nan::ThrowError("Needs one argument of type buffer or string");
+        return;
+    }
+    Nan::HandleScope scope;
+    data.ensure();
 
-    v8::Local<v8::Object> obj = v8::Local<v8::Object>::Cast(args[0]);
+    std::string contents;
+    if (node::Buffer::HasInstance(args[0])) {
+        contents.assign(node::Buffer::Data(args[0]), node::Buffer::Length(args[0]));
+    } else {
+        const std::string path = *v8::String::Utf8Value(args[0]);
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            Nan::ThrowError(("Unable to open " + path + ": " + strerror(errno)).c_str());
+            return;
+        }
+        char buf[16384];
+        size_t r;
+        while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
+            contents.append(buf, r);
+        fclose(f);
+    }
 
-    auto classStr = Nan::New("class").ToLocalChecked();
-    auto dataStr = Nan::New("data").ToLocalChecked();
-    if (!obj->Has(dataStr) || !obj->Has(classStr)) {
-        Nan::ThrowError("Needs a class and data property");
+    JsonValue rules;
+    std::string error;
+    JsonParser parser(contents.data(), contents.size());
+    if (!parser.parse(&rules, &error)) {
+        Nan::ThrowError(error.c_str());
         return;
     }
-    ForWindowClass(obj->Get(Nan::GetCurrentContext(), classStr).ToLocalChecked(),
-                   obj->Get(Nan::GetCurrentContext(), dataStr).ToLocalChecked());
+
+    RuleLoader loader;
+    loader.load(rules);
+    loader.finish();
+    if (!loader.errors().empty()) {
+        std::string message;
+        for (const auto& err : loader.errors()) {
+            if (!message.empty())
+                message += "\n";
+            message += err;
+        }
+        Nan::ThrowError(message.c_str());
+        return;
+    }
+    data.updateEventMask();
+    // interning may have queued events uv_poll won't tell us about
+    data.processEvents();
+}
+
+static void TakeSnapshot(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        Nan::ThrowError("Needs a path");
+        return;
+    }
+    Nan::HandleScope scope;
+    auto ctx = Nan::GetCurrentContext();
+    data.ensure();
+
+    const std::string path = *v8::String::Utf8Value(args[0]);
+
+    // intern all requested atoms in one go
+    std::vector<xcb_atom_t> atoms;
+    if (args.Length() > 1 && args[1]->IsObject()) {
+        v8::Local<v8::Object> obj = v8::Local<v8::Object>::Cast(args[1]);
+        auto atomsStr = Nan::New("atoms").ToLocalChecked();
+        if (obj->Has(atomsStr)) {
+            auto atomsVal = obj->Get(ctx, atomsStr).ToLocalChecked();
+            if (!atomsVal->IsArray()) {
+                Nan::ThrowError("atoms needs to be an array");
+                return;
+            }
+            v8::Local<v8::Array> arr = v8::Local<v8::Array>::Cast(atomsVal);
+            std::vector<std::pair<size_t, xcb_intern_atom_cookie_t> > cookies;
+            for (uint32_t i = 0; i < arr->Length(); ++i) {
+                auto val = arr->Get(ctx, i).ToLocalChecked();
+                if (val->IsNumber()) {
+                    atoms.push_back(v8::Local<v8::Uint32>::Cast(val)->Value());
+                } else {
+                    v8::String::Utf8Value str(val);
+                    cookies.push_back(std::make_pair(atoms.size(), xcb_intern_atom(data.conn, 1, str.length(), *str)));
+                    atoms.push_back(XCB_ATOM_NONE);
+                }
+            }
+            for (const auto& cookie : cookies) {
+                xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(data.conn, cookie.second, nullptr);
+                if (reply) {
+                    atoms[cookie.first] = reply->atom;
+                    free(reply);
+                }
+            }
+            // atoms that don't exist can't be set on any window
+            atoms.erase(std::remove(atoms.begin(), atoms.end(), XCB_ATOM_NONE), atoms.end());
+        }
+    }
+
+    SnapshotWriter writer(atoms);
+    writer.collect();
+    // the round trips above may have queued events uv_poll won't tell us about
+    data.processEvents();
+    std::string error;
+    if (!writer.write(path, &error)) {
+        Nan::ThrowError(error.c_str());
+        return;
+    }
+}
+
+static void DiffSnapshots(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsString()) {
+        Nan::ThrowError("Needs two snapshot paths");
+        return;
+    }
+    Nan::HandleScope scope;
+    auto iso = v8::Isolate::GetCurrent();
+
+    SnapshotReader a, b;
+    std::string error;
+    if (!a.open(*v8::String::Utf8Value(args[0]), &error) || !b.open(*v8::String::Utf8Value(args[1]), &error)) {
+        Nan::ThrowError(error.c_str());
+        return;
+    }
+
+    const std::unordered_set<uint32_t> shared = a.sharedAtoms(b);
+
+    // windows are sorted by id in both files, walk them side by side
+    v8::Local<v8::Array> added = v8::Array::New(iso);
+    v8::Local<v8::Array> removed = v8::Array::New(iso);
+    v8::Local<v8::Array> changed = v8::Array::New(iso);
+    const SnapshotWindow* aw = a.windows();
+    const SnapshotWindow* bw = b.windows();
+    const SnapshotWindow* aend = aw + a.header()->windowCount;
+    const SnapshotWindow* bend = bw + b.header()->windowCount;
+    while (aw != aend || bw != bend) {
+        if (bw == bend || (aw != aend && aw->window < bw->window)) {
+            removed->Set(removed->Length(), v8::Number::New(iso, aw->window));
+            ++aw;
+        } else if (aw == aend || bw->window < aw->window) {
+            added->Set(added->Length(), v8::Number::New(iso, bw->window));
+            ++bw;
+        } else {
+            if (!a.sameWindow(*aw, b, *bw, shared))
+                changed->Set(changed->Length(), v8::Number::New(iso, aw->window));
+            ++aw;
+            ++bw;
+        }
+    }
+
+    v8::Local<v8::Object> obj = v8::Object::New(iso);
+    obj->Set(Nan::New("added").ToLocalChecked(), added);
+    obj->Set(Nan::New("removed").ToLocalChecked(), removed);
+    obj->Set(Nan::New("changed").ToLocalChecked(), changed);
+    args.GetReturnValue().Set(obj);
+}
+
+static void StartTrace(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    // records are 64 bytes, cap the buffer at 256MB
+    const uint32_t maxCapacity = 4 * 1024 * 1024;
+    uint32_t capacity = 65536;
+    if (args.Length() > 0 && !args[0]->IsUndefined()) {
+        if (!args[0]->IsUint32()) {
+            Nan::ThrowError("Capacity needs to be an unsigned integer");
+            return;
+        }
+        capacity = v8::Local<v8::Uint32>::Cast(args[0])->Value();
+        if (!capacity || capacity > maxCapacity) {
+            Nan::ThrowError(("Capacity needs to be between 1 and " + std::to_string(maxCapacity)).c_str());
+            return;
+        }
+    }
+    data.tracer.start(capacity);
+}
+
+static void StopTrace(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    data.tracer.stop();
+}
+
+static void ExportTrace(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    args.GetReturnValue().Set(Nan::New(data.tracer.json()).ToLocalChecked());
+}
+
+static void SetPrefetch(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 1 || !args[0]->IsBoolean()) {
+        Nan::ThrowError("Needs one argument of type boolean");
+        return;
+    }
+    data.prefetch = v8::Local<v8::Boolean>::Cast(args[0])->Value();
+}
+
+static void SetBudget(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    if (args.Length() != 1 || !args[0]->IsNumber()) {
+        Nan::ThrowError("Needs one argument of type number");
+        return;
+    }
+    // milliseconds per event loop iteration, at most a second
+    const double maxBudget = 1000;
+    const double ms = v8::Local<v8::Number>::Cast(args[0])->Value();
+    if (!std::isfinite(ms) || ms < 0) {
+        Nan::ThrowError("Budget needs to be a finite, non-negative number");
+        return;
+    }
+    data.scheduler.setBudget(static_cast<uint64_t>(std::min(ms, maxBudget) * 1000000));
+}
+
+static void Stats(const Nan::FunctionCallbackInfo<v8::Value>& args)
+{
+    Nan::HandleScope scope;
+    auto iso = v8::Isolate::GetCurrent();
+    v8::Local<v8::Object> obj = v8::Object::New(iso);
+    obj->Set(Nan::New("wakeups").ToLocalChecked(), v8::Number::New(iso, data.stats.wakeups));
+    obj->Set(Nan::New("events").ToLocalChecked(), v8::Number::New(iso, data.stats.events));
+    obj->Set(Nan::New("ignored").ToLocalChecked(), v8::Number::New(iso, data.stats.ignored));
+    obj->Set(Nan::New("elided").ToLocalChecked(), v8::Number::New(iso, data.stats.elided));
+    obj->Set(Nan::New("units").ToLocalChecked(), v8::Number::New(iso, data.stats.units));
+    obj->Set(Nan::New("yields").ToLocalChecked(), v8::Number::New(iso, data.stats.yields));
+    obj->Set(Nan::New("rootSelected").ToLocalChecked(), v8::Boolean::New(iso, data.rootSelected));
+    args.GetReturnValue().Set(obj);
 }
 
 static v8::Local<v8::Object> getAtoms()
@@ -784,8 +2372,26 @@ static void Initialize(v8::Local<v8::Object> exports)
 {
     exports->Set(Nan::New("forWindow").ToLocalChecked(),
                  Nan::New<v8::FunctionTemplate>(ForWindow)->GetFunction());
+    exports->Set(Nan::New("loadRules").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(LoadRules)->GetFunction());
     exports->Set(Nan::New("start").ToLocalChecked(),
                  Nan::New<v8::FunctionTemplate>(Start)->GetFunction());
+    exports->Set(Nan::New("snapshot").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(TakeSnapshot)->GetFunction());
+    exports->Set(Nan::New("diffSnapshots").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(DiffSnapshots)->GetFunction());
+    exports->Set(Nan::New("startTrace").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(StartTrace)->GetFunction());
+    exports->Set(Nan::New("stopTrace").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(StopTrace)->GetFunction());
+    exports->Set(Nan::New("exportTrace").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(ExportTrace)->GetFunction());
+    exports->Set(Nan::New("setPrefetch").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(SetPrefetch)->GetFunction());
+    exports->Set(Nan::New("setBudget").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(SetBudget)->GetFunction());
+    exports->Set(Nan::New("stats").ToLocalChecked(),
+                 Nan::New<v8::FunctionTemplate>(Stats)->GetFunction());
     exports->Set(Nan::New("atoms").ToLocalChecked(), getAtoms());
 }
 